@@ -17,11 +17,23 @@
 
 #include "ble-dbus.h"
 
+// Bluez tells which device issued a GATT request in its "device" option
+static QString requestingDevice(const QVariantMap &options) {
+    return qvariant_cast<QDBusObjectPath>(options.value("device")).path();
+}
+
 // Called when a companion writes to the RX characteristic
-void RXChrc::WriteValue(QByteArray data, QVariantMap) {
+void RXChrc::WriteValue(QByteArray data, QVariantMap options) {
+    emit companionSeen(requestingDevice(options));
     emit receivedFromCompanion(data);
 }
 
+// Called when a companion reads the TX characteristic
+QByteArray TXChrc::ReadValue(QVariantMap options) {
+    emit companionSeen(requestingDevice(options));
+    return m_value;
+}
+
 // Forwards information to the companion by notifications on the TX characteristic
 void TXChrc::sendToCompanion(QByteArray content) {
     m_value = content;
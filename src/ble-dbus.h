@@ -58,10 +58,11 @@ public slots:
     QByteArray ReadValue(QVariantMap options) { return QByteArray(); }
     void StartNotify() {}
     void StopNotify() {}
-    void WriteValue(QByteArray data, QVariantMap);
+    void WriteValue(QByteArray data, QVariantMap options);
 
 signals:
     void receivedFromCompanion(const QByteArray &);
+    void companionSeen(const QString &device);
 };
 
 // Notifiable characteristic for watch to companion communication
@@ -84,14 +85,16 @@ public:
 
 public slots:
     void WriteValue(QByteArray value, QVariantMap options) {}
-    void StartNotify() {}
-    void StopNotify() {}
-    QByteArray ReadValue(QVariantMap) { return m_value; }
+    void StartNotify() { emit notifyingChanged(true); }
+    void StopNotify() { emit notifyingChanged(false); }
+    QByteArray ReadValue(QVariantMap options);
 
     void sendToCompanion(QByteArray content);
 
 signals:
     void valueChanged();
+    void notifyingChanged(bool notifying);
+    void companionSeen(const QString &device);
 
 private:
     void emitPropertiesChanged() {
@@ -47,6 +47,12 @@ BLE::BLE(QObject *parent) : QObject(parent), mBus(QDBusConnection::systemBus())
     bus.registerObject(APPLICATION_PATH, mApplication, QDBusConnection::ExportAllSlots | QDBusConnection::ExportAllProperties);
 
     mConnected = false;
+    // Bluez keeps the subscription of bonded devices across restarts and
+    // reconnections without telling, so assume one until told otherwise
+    mNotifying = true;
+    mLastRecvSeqNum = -1;
+    mHeldBytes = 0;
+    mClock.start();
 
     mWatcher = new QDBusServiceWatcher(BLUEZ_SERVICE_NAME, mBus);
     connect(mWatcher, SIGNAL(serviceRegistered(const QString &)),
@@ -58,6 +64,9 @@ BLE::BLE(QObject *parent) : QObject(parent), mBus(QDBusConnection::systemBus())
     connect(this, SIGNAL(connectedChanged()), this, SLOT(onConnectedChanged()));
 
     connect(&mRX, SIGNAL(receivedFromCompanion(QByteArray)), this, SLOT(onReceivedFromCompanion(QByteArray)));
+    connect(&mRX, SIGNAL(companionSeen(QString)), this, SLOT(onCompanionSeen(QString)));
+    connect(&mTX, SIGNAL(companionSeen(QString)), this, SLOT(onCompanionSeen(QString)));
+    connect(&mTX, SIGNAL(notifyingChanged(bool)), this, SLOT(onNotifyingChanged(bool)));
 
     QDBusInterface remoteOm(BLUEZ_SERVICE_NAME, "/", DBUS_OM_IFACE, mBus);
     if (remoteOm.isValid())
@@ -94,7 +103,8 @@ void BLE::bluezPropertiesChanged(QString, QMap<QString, QVariant>, QStringList)
 
 void BLE::updateAdapter() {
     QString adapter = "";
-    bool connected = false;
+    bool anyConnected = false;
+    bool companionConnected = false;
 
     QDBusInterface remoteOm(BLUEZ_SERVICE_NAME, "/", DBUS_OM_IFACE, mBus);
     QDBusMessage result = remoteOm.call("GetManagedObjects");
@@ -117,15 +127,18 @@ void BLE::updateAdapter() {
                  mBus.connect(BLUEZ_SERVICE_NAME, key, DBUS_PROPERTIES_IFACE, "PropertiesChanged",
                          this, SLOT(bluezPropertiesChanged(QString, QMap<QString, QVariant>, QStringList)));
                  QMap<QString, QVariant> properties = value.value(DEVICE_MANAGER_IFACE);
-                 if (properties.contains("Connected"))
-                    connected |= properties.value("Connected").toBool();
+                 bool deviceConnected = properties.value("Connected").toBool();
+                 anyConnected |= deviceConnected;
+                 if (key == mCompanion)
+                    companionConnected = deviceConnected;
             }
         }
         argument.endMap();
     }
 
     setAdapter(adapter);
-    setConnected(connected);
+    // Once the companion is known, other peripherals' links do not matter
+    setConnected(mCompanion.isEmpty() ? anyConnected : companionConnected);
 }
 
 void BLE::setAdapter(QString adapter) {
@@ -156,17 +169,176 @@ void BLE::onAdapterChanged() {
 }
 
 void BLE::onConnectedChanged() {
+    // Whatever was half-received belongs to the previous link
+    resetReassembly();
+
     if (mConnected) {
-        qDebug() << "Connected";
+        qDebug() << "Companion" << mCompanion << "connected";
+        if (readyToSend())
+            flushHeldFrames();
     } else {
-        qDebug() << "Disconnected";
+        qDebug() << "Companion disconnected, holding outgoing frames";
     }
 }
 
+// The companion is the device making GATT requests on the service, which
+// tells it apart from any other peripheral connected to the watch
+void BLE::onCompanionSeen(const QString &device) {
+    if (device.isEmpty() || device == mCompanion)
+        return;
+
+    // A stray request from another device while the companion is around
+    if (!mCompanion.isEmpty() && mConnected)
+        return;
+
+    // Held frames are only meaningful to the companion they were meant for
+    if (!mCompanion.isEmpty() && !mHeldFrames.isEmpty()) {
+        qDebug() << "Dropping" << mHeldFrames.size() << "frames held for" << mCompanion;
+        mHeldFrames.clear();
+        mHeldBytes = 0;
+    }
+
+    mCompanion = device;
+    updateAdapter();
+}
+
+// Only follows what Bluez reports: it calls StartNotify and StopNotify when
+// the number of subscribers changes, not on every reconnection
+void BLE::onNotifyingChanged(bool notifying) {
+    mNotifying = notifying;
+
+    if (readyToSend())
+        flushHeldFrames();
+}
+
+bool BLE::readyToSend() {
+    return mConnected && mNotifying;
+}
+
 // TODO: This should be determined dynamically based on the BLE MTU
 #define CHUNK_SIZE 240
 
+// Bounds of the queue of frames held while the companion is disconnected
+#define HELD_MAX_FRAMES 128
+#define HELD_MAX_BYTES  (64 * 1024)
+#define HELD_TTL_MS     10000
+
+#define TCP_FIN 0x01
+#define TCP_RST 0x04
+
+// ARP, ICMP and TCP SYNs or pure ACKs are small and unblock the peer's state
+// machines, so they go out first after a reconnection. They can safely
+// overtake earlier data, unlike a FIN or RST which must stay behind it.
+static bool isTcpControl(const uint8_t *tcp, int payloadLength) {
+    return payloadLength <= 0 && !(tcp[13] & (TCP_FIN | TCP_RST));
+}
+
+static bool isPriorityFrame(const QByteArray &frame) {
+    const uint8_t *data = (const uint8_t *)frame.constData();
+    int size = frame.size();
+
+    if (size < 14)
+        return false;
+
+    uint16_t etherType = (data[12] << 8) | data[13];
+    const uint8_t *ip = data + 14;
+    size -= 14;
+
+    if (etherType == 0x0806)
+        return true;
+
+    if (etherType == 0x0800 && size >= 20) {
+        int ihl = (ip[0] & 0x0F) * 4;
+        int totalLength = (ip[2] << 8) | ip[3];
+        int fragmentOffset = ((ip[6] & 0x1F) << 8) | ip[7];
+        // Only the first fragment carries the transport header
+        if (ihl < 20 || fragmentOffset != 0)
+            return false;
+        if (ip[9] == 1)
+            return true;
+        if (ip[9] == 6 && size >= ihl + 20)
+            return isTcpControl(ip + ihl, totalLength - ihl - (ip[ihl + 12] >> 4) * 4);
+    }
+
+    // Only the fixed header's next header is looked at: packets with extension
+    // headers are rare enough to be treated as bulk traffic
+    if (etherType == 0x86DD && size >= 40) {
+        int payloadLength = (ip[4] << 8) | ip[5];
+        if (ip[6] == 58)
+            return true;
+        if (ip[6] == 6 && size >= 60)
+            return isTcpControl(ip + 40, payloadLength - (ip[52] >> 4) * 4);
+    }
+
+    return false;
+}
+
 void BLE::sendToCompanion(const QByteArray &content) {
+    if (readyToSend())
+        sendFrame(content);
+    else
+        holdFrame(content);
+}
+
+void BLE::holdFrame(const QByteArray &content) {
+    dropExpiredFrames();
+
+    if (content.size() > HELD_MAX_BYTES)
+        return;
+
+    // Make room by dropping the oldest frames, the least likely to still be
+    // useful, but keep priority frames for as long as there is bulk to drop
+    while (!mHeldFrames.isEmpty() && (mHeldFrames.size() >= HELD_MAX_FRAMES
+                || mHeldBytes + content.size() > HELD_MAX_BYTES)) {
+        int victim = 0;
+        for (int i = 0; i < mHeldFrames.size(); i++) {
+            if (!mHeldFrames.at(i).priority) {
+                victim = i;
+                break;
+            }
+        }
+        mHeldBytes -= mHeldFrames.at(victim).data.size();
+        mHeldFrames.removeAt(victim);
+    }
+
+    HeldFrame frame;
+    frame.data = content;
+    frame.timestamp = mClock.elapsed();
+    frame.priority = isPriorityFrame(content);
+    mHeldFrames.append(frame);
+    mHeldBytes += content.size();
+}
+
+void BLE::dropExpiredFrames() {
+    qint64 now = mClock.elapsed();
+
+    while (!mHeldFrames.isEmpty() && now - mHeldFrames.first().timestamp > HELD_TTL_MS) {
+        mHeldBytes -= mHeldFrames.first().data.size();
+        mHeldFrames.removeFirst();
+    }
+}
+
+void BLE::flushHeldFrames() {
+    dropExpiredFrames();
+
+    if (mHeldFrames.isEmpty())
+        return;
+
+    qDebug() << "Flushing" << mHeldFrames.size() << "held frames";
+
+    QList<HeldFrame> frames;
+    frames.swap(mHeldFrames);
+    mHeldBytes = 0;
+
+    for (const HeldFrame &frame : frames)
+        if (frame.priority)
+            sendFrame(frame.data);
+    for (const HeldFrame &frame : frames)
+        if (!frame.priority)
+            sendFrame(frame.data);
+}
+
+void BLE::sendFrame(const QByteArray &content) {
     uint8_t seqNum = 0;
     int currentIndex = 0;
 
@@ -184,26 +356,30 @@ void BLE::sendToCompanion(const QByteArray &content) {
     }
 }
 
+void BLE::resetReassembly() {
+    mAccumulatedRecv = QByteArray();
+    mLastRecvSeqNum = -1;
+}
+
 void BLE::onReceivedFromCompanion(const QByteArray &content) {
-    static int8_t lastSeqNum = -1;
+    if (content.isEmpty())
+        return;
 
     uint8_t header = content.at(0);
     bool hasMore = !!(header & 0x80);
     uint8_t seqNum = header & 0x7F;
 
-    if (seqNum != lastSeqNum + 1) {
-        mAccumulatedRecv = QByteArray();
-        lastSeqNum = -1;
+    if (seqNum != mLastRecvSeqNum + 1) {
+        resetReassembly();
         return;
     }
 
-    lastSeqNum = seqNum;
+    mLastRecvSeqNum = seqNum;
     mAccumulatedRecv.append(content.mid(1, -1));
 
     if (!hasMore) {
         emit receivedFromCompanion(mAccumulatedRecv);
-        mAccumulatedRecv = QByteArray();
-        lastSeqNum = -1;
+        resetReassembly();
     }
 }
 
@@ -22,6 +22,7 @@
 #include <QDBusObjectPath>
 #include <QDBusServiceWatcher>
 #include <QDBusConnection>
+#include <QElapsedTimer>
 
 #include "ble-dbus.h"
 
@@ -45,13 +46,33 @@ private:
     QDBusServiceWatcher *mWatcher;
     QDBusConnection mBus;
     QString mAdapter;
+    QString mCompanion;
     bool mConnected;
+    bool mNotifying;
 
     void updateAdapter();
     void setAdapter(QString adatper);
     void setConnected(bool connected);
+    bool readyToSend();
+
+    void sendFrame(const QByteArray &data);
+    void holdFrame(const QByteArray &data);
+    void dropExpiredFrames();
+    void flushHeldFrames();
+    void resetReassembly();
 
     QByteArray mAccumulatedRecv;
+    int8_t mLastRecvSeqNum;
+
+    // Frames read from the TAP while the companion cannot receive them
+    struct HeldFrame {
+        QByteArray data;
+        qint64 timestamp;
+        bool priority;
+    };
+    QList<HeldFrame> mHeldFrames;
+    int mHeldBytes;
+    QElapsedTimer mClock;
 
 signals:
     void connectedChanged();
@@ -70,6 +91,8 @@ public slots:
 
 private slots:
     void onReceivedFromCompanion(const QByteArray &data);
+    void onCompanionSeen(const QString &device);
+    void onNotifyingChanged(bool notifying);
 };
 
 #endif // BLE_H